@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef KITTY_PATH
+#define KITTY_PATH "./hw1"
+#endif
+
+#define GEN_BUF (1 << 20)
+#define SPARSE_STRIDE (64LL << 20)
+#define MAX_REPS 32
+#define MAX_FLAGS 8
+
+#define TEXT 0
+#define SPARSE 1
+#define PIPE 2
+
+struct corpus {
+    char* name;
+    int nfiles;
+    long long size;
+    int kind;
+    char* source; // PIPE corpora stream another corpus's first file
+};
+
+struct strategy {
+    char* name;
+    char* flags[MAX_FLAGS];
+    bool multi_only;
+};
+
+struct result {
+    double wall, cpu, mb_s;
+    long long syscalls;
+};
+
+struct strategy strategies[] = {
+    {"auto", {NULL}, false},
+    {"rw-4k", {"-R", "-b", "4k", NULL}, false},
+    {"rw-64k", {"-R", "-b", "64k", NULL}, false},
+    {"rw-1m", {"-R", "-b", "1m", NULL}, false},
+    {"mmap", {"-M", NULL}, false},
+    {"uring-64k", {"-U", "-q", "4", "-b", "64k", NULL}, false},
+    {"uring-1m", {"-U", "-q", "4", "-b", "1m", NULL}, false},
+    {"parallel-4", {"-j", "4", NULL}, true},
+};
+
+char* kitty = KITTY_PATH;
+char* workdir = "bench_kitty.d";
+char text[GEN_BUF];
+
+void die(char* what, char* name) {
+    fprintf(stderr, "%s %s: %s\n", what, name, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char* corpus_file(struct corpus* c, int i) {
+    static char path[4096];
+    snprintf(path, sizeof(path), "%s/%s/%05d", workdir, c->name, i);
+    return path;
+}
+
+// Text so kitty's binary detection has to look at every byte, except for
+// the sparse corpus whose holes make it binary anyway.
+void generate_file(char* path, long long size, int kind) {
+    struct stat sb;
+    long long off = 0, len;
+    int fd;
+
+    if (stat(path, &sb) == 0 && sb.st_size == size) return;
+    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) die("Can't open file for writing", path);
+    if (kind == SPARSE && ftruncate(fd, size) < 0) die("Can't size file", path);
+    while (off < size) {
+        len = (size - off < GEN_BUF) ? size - off : GEN_BUF;
+        if (pwrite(fd, text, len, off) != len) die("Can't write file", path);
+        off += (kind == SPARSE) ? SPARSE_STRIDE : len;
+    }
+    // written back now so the cold runs can drop it from the cache
+    fdatasync(fd);
+    close(fd);
+}
+
+void generate(struct corpus* c) {
+    char dir[4096];
+    if (c->kind == PIPE) return;
+    snprintf(dir, sizeof(dir), "%s/%s", workdir, c->name);
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) die("Can't create directory", dir);
+    fprintf(stderr, "Generating %s: %d x %lld bytes\n", c->name, c->nfiles, c->size);
+    for (int i = 0; i < c->nfiles; i++) generate_file(corpus_file(c, i), c->size, c->kind);
+}
+
+// Without root the page cache can't be dropped wholesale, but clean pages
+// of one file can.
+void drop_cache(struct corpus* c) {
+    int fd;
+    for (int i = 0; i < c->nfiles; i++) {
+        if ((fd = open(corpus_file(c, i), O_RDONLY)) < 0) continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+long long sum_key(char* json, char* key) {
+    long long sum = 0;
+    size_t len = strlen(key);
+    for (char* p = json; (p = strstr(p, key)); p += len) sum += strtoll(p + len, NULL, 10);
+    return sum;
+}
+
+// Streams a file into the pipe kitty reads as stdin.
+pid_t start_feeder(char* path, int fd_w) {
+    pid_t pid = fork();
+    ssize_t n;
+    int fd;
+    if (pid != 0) return pid;
+    if ((fd = open(path, O_RDONLY)) < 0) die("Can't open file for reading", path);
+    while ((n = read(fd, text, GEN_BUF)) > 0) {
+        if (write(fd_w, text, n) != n) _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+struct result run_kitty(struct corpus* c, struct corpus* src, struct strategy* s) {
+    char** args = calloc(c->nfiles + MAX_FLAGS + 8, sizeof(char*));
+    char out[4096], *json = NULL;
+    size_t json_len = 0, json_cap = 0;
+    struct result r;
+    struct rusage ru;
+    int telemetry[2], feed[2] = {-1, -1}, status, n = 0;
+    pid_t pid, feeder = -1;
+    ssize_t got;
+    double start;
+
+    if (args == NULL) die("Failed to allocate memory", "");
+    snprintf(out, sizeof(out), "%s/out", workdir);
+    unlink(out);
+    args[n++] = kitty;
+    for (int i = 0; s->flags[i]; i++) args[n++] = s->flags[i];
+    args[n++] = "--json=3";
+    args[n++] = "-o";
+    args[n++] = out;
+    if (c->kind == PIPE) args[n++] = "-";
+    else for (int i = 0; i < c->nfiles; i++) args[n++] = strdup(corpus_file(c, i));
+    args[n] = NULL;
+
+    if (pipe2(telemetry, O_CLOEXEC) < 0) die("Can't create pipe", "");
+    if (c->kind == PIPE && pipe2(feed, O_CLOEXEC) < 0) die("Can't create pipe", "");
+    start = now();
+    if ((pid = fork()) == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(feed[0] >= 0 ? feed[0] : null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        dup2(telemetry[1], 3);
+        execv(kitty, args);
+        _exit(127);
+    }
+    if (pid < 0) die("Can't fork", kitty);
+    close(telemetry[1]);
+    if (c->kind == PIPE) {
+        close(feed[0]);
+        feeder = start_feeder(corpus_file(src, 0), feed[1]);
+        close(feed[1]);
+    }
+    // kitty blocks on a full telemetry pipe, so drain it while it runs
+    for (;;) {
+        if (json_len + 4096 > json_cap) {
+            json_cap = json_cap ? json_cap * 2 : 65536;
+            if ((json = realloc(json, json_cap)) == NULL) die("Failed to allocate memory", "");
+        }
+        if ((got = read(telemetry[0], json + json_len, json_cap - json_len - 1)) <= 0) break;
+        json_len += got;
+    }
+    json[json_len] = '\0';
+    close(telemetry[0]);
+    if (wait4(pid, &status, 0, &ru) < 0) die("Can't wait for", kitty);
+    r.wall = now() - start;
+    if (feeder > 0) waitpid(feeder, NULL, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed on %s with %s\n", kitty, c->name, s->name);
+        exit(EXIT_FAILURE);
+    }
+    r.cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    r.syscalls = sum_key(json, "\"read_calls\":") + sum_key(json, "\"write_calls\":") + sum_key(json, "\"copy_calls\":");
+    r.mb_s = (double)c->nfiles * c->size / r.wall / 1e6;
+    if (c->kind != PIPE) {
+        for (int i = n - c->nfiles; i < n; i++) free(args[i]);
+    }
+    free(args);
+    free(json);
+    return r;
+}
+
+int by_wall(const void* a, const void* b) {
+    double d = ((struct result*)a)->wall - ((struct result*)b)->wall;
+    return (d > 0) - (d < 0);
+}
+
+// Median run of reps; cold runs drop the inputs from the cache before each.
+struct result measure(struct corpus* c, struct corpus* src, struct strategy* s, bool cold, int reps) {
+    struct result runs[MAX_REPS];
+    if (!cold) run_kitty(c, src, s);
+    for (int i = 0; i < reps; i++) {
+        if (cold) drop_cache(src);
+        runs[i] = run_kitty(c, src, s);
+    }
+    qsort(runs, reps, sizeof(struct result), by_wall);
+    return runs[reps / 2];
+}
+
+long long parse_size(char* s) {
+    char* end;
+    long long num = strtoll(s, &end, 10);
+    if (end == s || num <= 0) {
+        fprintf(stderr, "Invalid size %s\n", s);
+        exit(EXIT_FAILURE);
+    }
+    switch (*end) {
+        case 'k': case 'K': return num << 10;
+        case 'm': case 'M': return num << 20;
+        case 'g': case 'G': return num << 30;
+    }
+    return num;
+}
+
+int main(int argc, char *argv[]) {
+    long long large = 2LL << 30;
+    int opt, reps = 3;
+    char* csv_path = NULL;
+    char csv_default[4096];
+    FILE* csv;
+
+    while ((opt = getopt(argc, argv, "k:d:s:r:c:")) != -1) {
+        switch (opt) {
+            case 'k': kitty = optarg; break;
+            case 'd': workdir = optarg; break;
+            case 's': large = parse_size(optarg); break;
+            case 'r': reps = atoi(optarg); break;
+            case 'c': csv_path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: bench_kitty [-k kitty] [-d workdir] [-s large_size] [-r reps] [-c results.csv]\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (reps < 1 || reps > MAX_REPS) {
+        fprintf(stderr, "Repetitions must be between 1 and %d\n", MAX_REPS);
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(workdir, 0777) < 0 && errno != EEXIST) die("Can't create directory", workdir);
+    if (csv_path == NULL) {
+        snprintf(csv_default, sizeof(csv_default), "%s/results.csv", workdir);
+        csv_path = csv_default;
+    }
+    for (int i = 0; i < GEN_BUF; i++) text[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+
+    struct corpus corpora[] = {
+        {"tiny", 256, 64, TEXT, NULL},
+        {"small-4k", 4096, 4096, TEXT, NULL},
+        {"large", 1, large, TEXT, NULL},
+        {"sparse", 1, large, SPARSE, NULL},
+        {"pipe", 1, large, PIPE, "large"},
+    };
+    int ncorpora = sizeof(corpora) / sizeof(corpora[0]);
+    int nstrategies = sizeof(strategies) / sizeof(strategies[0]);
+
+    for (int i = 0; i < ncorpora; i++) generate(&corpora[i]);
+    if ((csv = fopen(csv_path, "w")) == NULL) die("Can't open file for writing", csv_path);
+    fprintf(csv, "corpus,strategy,cache,mb_per_s,wall_s,cpu_s,syscalls\n");
+    printf("%-10s %-12s %-5s %10s %9s %9s %10s\n", "corpus", "strategy", "cache", "MB/s", "wall s", "cpu s", "syscalls");
+    for (int i = 0; i < ncorpora; i++) {
+        struct corpus* c = &corpora[i];
+        struct corpus* src = c;
+        for (int k = 0; c->source && k < ncorpora; k++) {
+            if (strcmp(corpora[k].name, c->source) == 0) src = &corpora[k];
+        }
+        for (int j = 0; j < nstrategies; j++) {
+            if (strategies[j].multi_only && c->nfiles == 1) continue;
+            for (int cold = 1; cold >= 0; cold--) {
+                struct result r = measure(c, src, &strategies[j], cold, reps);
+                printf("%-10s %-12s %-5s %10.1f %9.4f %9.4f %10lld\n", c->name, strategies[j].name, cold ? "cold" : "warm", r.mb_s, r.wall, r.cpu, r.syscalls);
+                fprintf(csv, "%s,%s,%s,%.1f,%.6f,%.6f,%lld\n", c->name, strategies[j].name, cold ? "cold" : "warm", r.mb_s, r.wall, r.cpu, r.syscalls);
+                fflush(stdout);
+            }
+        }
+    }
+    fclose(csv);
+    fprintf(stderr, "Results written to %s\n", csv_path);
+    return 0;
+}
@@ -1,13 +1,39 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 #define BUF_SIZE 4096
+#define COPY_CHUNK (1 << 30)
+#define PIPE_CHUNK 65536
+#define URING_DEPTH 4
+#define URING_BLOCK (128 * 1024)
+#define MMAP_WINDOW (16 << 20)
+#define VERIFY_BUF (1 << 20)
+#define FANOUT_RING (1 << 20)
+#define CRC32C_POLY 0x82f63b78
+#define HIST_BUCKETS 40
 
 #define READ 0
 #define WRITE 1
@@ -16,9 +42,188 @@
 #define WOPEN 4
 #define ROPEN 5
 
-void report(char* infile, char* outfile, int bytes, int r_cnt, int w_cnt, bool is_binary) {
-    fprintf(stderr, "From %s to %s, %d bytes transferred, %d read system calls were made, and %d write system calls were made.\n", infile, outfile, bytes, r_cnt, w_cnt);
-    if (is_binary) fprintf(stderr, "Warning: %s contains binary.\n", infile);
+#define RW_LOOP 0
+#define COPY_RANGE 1
+#define SENDFILE 2
+#define SPLICE 3
+#define URING 4
+#define MMAP 5
+
+#define LAT_READ 0
+#define LAT_WRITE 1
+#define LAT_COPY 2
+
+#define B_FREE 0
+#define B_READING 1
+#define B_FULL 2
+#define B_WRITING 3
+
+char* strategy_names[] = {"read/write", "copy_file_range", "sendfile", "splice", "io_uring_enter", "mmap"};
+
+bool detect_binary = true, checksum = false, verify = false;
+FILE* json_out;
+
+// Call latencies in log2 buckets: hist[i] counts calls of 2^i to 2^(i+1) ns.
+struct latency {
+    long long hist[HIST_BUCKETS];
+    long long calls, total_ns;
+};
+
+struct stats {
+    long long bytes, holes;
+    int r_cnt, w_cnt, c_cnt;
+    int strategy;
+    bool is_binary;
+    uint32_t crc;
+    long long start_ns, end_ns;
+    long long rd_calls, rd_bytes, rd_min, rd_max;
+    struct latency lat[3];
+};
+
+// Window of a regular input file mapped so the kernel copy paths can still
+// look at the bytes for binary detection without copying them to user space.
+struct scan_map {
+    char* addr;
+    off_t len, pos;
+};
+
+// One registered buffer of the io_uring engine and the block it holds.
+struct uring_block {
+    long long k;
+    int state;
+    size_t len, done;
+    off_t off;
+};
+
+struct uring {
+    int fd;
+    unsigned depth, pending;
+    size_t block_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    char* bufs;
+    bool fixed;
+    struct uring_block* blocks;
+};
+
+bool use_uring = false, use_mmap = false, force_rw = false;
+size_t rw_block = BUF_SIZE;
+struct uring ring;
+
+// One input of -j mode; its place in the output is fixed before copying.
+struct job {
+    char* name;
+    off_t size, off;
+    struct stats st;
+};
+
+// One -o target. pos is how far into the current input it has been written.
+struct output {
+    char *name, *path;
+    int fd;
+    bool is_reg, is_pipe;
+    off_t start;
+    long long pos, bytes;
+    int w_cnt, c_cnt;
+};
+
+struct output* outputs;
+int nout;
+
+struct job* jobs;
+int njobs, next_job, fd_out;
+char* outname;
+
+// CRC32C of everything written so far, built from the per-input digests.
+uint32_t out_crc;
+long long out_len;
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Timing is only paid for with --json.
+long long lat_start() {
+    return json_out ? now_ns() : 0;
+}
+
+void lat_end(struct stats* st, int kind, long long t0, ssize_t n) {
+    long long ns;
+    int b;
+    if (!json_out) return;
+    ns = now_ns() - t0;
+    b = 63 - __builtin_clzll(ns | 1);
+    st->lat[kind].hist[(b < HIST_BUCKETS) ? b : HIST_BUCKETS - 1]++;
+    st->lat[kind].calls++;
+    st->lat[kind].total_ns += ns;
+    // EOF reads say nothing about how much a read brings back
+    if (kind == LAT_READ && n > 0) {
+        if (st->rd_calls == 0 || n < st->rd_min) st->rd_min = n;
+        if (n > st->rd_max) st->rd_max = n;
+        st->rd_calls++;
+        st->rd_bytes += n;
+    }
+}
+
+void json_string(char* str) {
+    fputc('"', json_out);
+    for (unsigned char* c = (unsigned char*)str; *c; c++) {
+        if (*c == '"' || *c == '\\') fprintf(json_out, "\\%c", *c);
+        else if (*c < 0x20) fprintf(json_out, "\\u%04x", *c);
+        else fputc(*c, json_out);
+    }
+    fputc('"', json_out);
+}
+
+void json_latency(char* name, struct latency* l) {
+    int top = HIST_BUCKETS;
+    while (top > 0 && l->hist[top - 1] == 0) top--;
+    fprintf(json_out, "\"%s\":{\"calls\":%lld,\"total_ns\":%lld,\"log2_ns_hist\":[", name, l->calls, l->total_ns);
+    for (int i = 0; i < top; i++) fprintf(json_out, "%s%lld", i ? "," : "", l->hist[i]);
+    fprintf(json_out, "]}");
+}
+
+// One JSON object per input file, for --json.
+void report_json(char* infile, char* outfile, struct stats* st) {
+    double wall = (st->end_ns - st->start_ns) / 1e9;
+    fprintf(json_out, "{\"input\":");
+    json_string(infile);
+    fprintf(json_out, ",\"output\":");
+    json_string(outfile);
+    fprintf(json_out, ",\"strategy\":\"%s\",\"bytes\":%lld,\"holes\":%lld,\"wall_s\":%.6f,\"mb_per_s\":%.3f", strategy_names[st->strategy], st->bytes, st->holes, wall, (wall > 0) ? st->bytes / wall / 1e6 : 0.0);
+    fprintf(json_out, ",\"read_calls\":%d,\"write_calls\":%d,\"copy_calls\":%d", st->r_cnt, st->w_cnt, st->c_cnt);
+    fprintf(json_out, ",\"read_bytes\":{\"min\":%lld,\"avg\":%.1f,\"max\":%lld}", st->rd_min, st->rd_calls ? (double)st->rd_bytes / st->rd_calls : 0.0, st->rd_max);
+    fprintf(json_out, ",\"latency\":{");
+    json_latency("read", &st->lat[LAT_READ]);
+    fputc(',', json_out);
+    json_latency("write", &st->lat[LAT_WRITE]);
+    fputc(',', json_out);
+    json_latency("copy", &st->lat[LAT_COPY]);
+    fprintf(json_out, "},\"binary\":%s", st->is_binary ? "true" : "false");
+    if (checksum) fprintf(json_out, ",\"crc32c\":\"%08x\"", st->crc);
+    fprintf(json_out, "}\n");
+    fflush(json_out);
+}
+
+void report(char* infile, char* outfile, struct stats* st) {
+    if (st->c_cnt)
+        fprintf(stderr, "From %s to %s, %lld bytes transferred, %d read system calls were made, %d write system calls were made, and %d %s system calls were made.\n", infile, outfile, st->bytes, st->r_cnt, st->w_cnt, st->c_cnt, strategy_names[st->strategy]);
+    else
+        fprintf(stderr, "From %s to %s, %lld bytes transferred, %d read system calls were made, and %d write system calls were made.\n", infile, outfile, st->bytes, st->r_cnt, st->w_cnt);
+    if (st->holes) fprintf(stderr, "%lld bytes of holes in %s were skipped and %lld bytes of data were moved.\n", st->holes, infile, st->bytes);
+    for (int i = 0; nout > 1 && i < nout; i++) {
+        if (outputs[i].c_cnt)
+            fprintf(stderr, "To %s, %lld bytes were written, %d write system calls were made, and %d %s system calls were made.\n", outputs[i].name, outputs[i].bytes, outputs[i].w_cnt, outputs[i].c_cnt, strategy_names[st->strategy]);
+        else
+            fprintf(stderr, "To %s, %lld bytes were written and %d write system calls were made.\n", outputs[i].name, outputs[i].bytes, outputs[i].w_cnt);
+    }
+    if (checksum) fprintf(stderr, "CRC32C of %s: %08x\n", infile, st->crc);
+    if (st->is_binary) fprintf(stderr, "Warning: %s contains binary.\n", infile);
+    if (json_out) report_json(infile, outfile, st);
 }
 
 void check_error(int fd, int n, char* filename, int type) {
@@ -43,62 +248,1308 @@ void check_error(int fd, int n, char* filename, int type) {
     }
 }
 
-bool check_binary(char buf[], int n) {
-    for (int i = 0; i < n; i++) {
+bool check_binary_scalar(char buf[], size_t n) {
+    for (size_t i = 0; i < n; i++) {
         if (!(isprint(buf[i]) || isspace(buf[i]))) return true;
     }
     return false;
 }
 
-int main(int argc, char *argv[]) {
-    char* outfile = NULL;
+// The vector paths hardcode the C locale's text set: '\t'..'\r' and ' '..'~'.
+bool is_text_byte(unsigned char c) {
+    return (c >= 0x20 && c < 0x7f) || (c >= '\t' && c <= '\r');
+}
+
+#ifdef HAVE_X86_SIMD
+// Both ranges are tested with one signed compare each by shifting the low end
+// of the range down to -128: b + 0x60 < -128 + 95 and b + 0x77 < -128 + 5.
+bool check_binary_sse2(char buf[], size_t n) {
+    const __m128i print_shift = _mm_set1_epi8(0x60), print_lim = _mm_set1_epi8(-128 + 0x5f);
+    const __m128i space_shift = _mm_set1_epi8(0x77), space_lim = _mm_set1_epi8(-128 + 5);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i text = _mm_or_si128(_mm_cmplt_epi8(_mm_add_epi8(v, print_shift), print_lim),
+                                    _mm_cmplt_epi8(_mm_add_epi8(v, space_shift), space_lim));
+        if (_mm_movemask_epi8(text) != 0xffff) return true;
+    }
+    return check_binary_scalar(buf + i, n - i);
+}
+
+__attribute__((target("avx2")))
+bool check_binary_avx2(char buf[], size_t n) {
+    const __m256i print_shift = _mm256_set1_epi8(0x60), print_lim = _mm256_set1_epi8(-128 + 0x5f);
+    const __m256i space_shift = _mm256_set1_epi8(0x77), space_lim = _mm256_set1_epi8(-128 + 5);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i text = _mm256_or_si256(_mm256_cmpgt_epi8(print_lim, _mm256_add_epi8(v, print_shift)),
+                                       _mm256_cmpgt_epi8(space_lim, _mm256_add_epi8(v, space_shift)));
+        if (_mm256_movemask_epi8(text) != -1) return true;
+    }
+    return check_binary_sse2(buf + i, n - i);
+}
+#endif
+
+bool (*check_binary)(char buf[], size_t n) = check_binary_scalar;
+
+// Picks the widest classifier the CPU has, but only if the current locale
+// agrees byte for byte with the set the vector code tests for.
+void init_check_binary() {
+    for (int c = 0; c < 256; c++) {
+        if ((isprint((char)c) || isspace((char)c)) != is_text_byte(c)) return;
+    }
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) check_binary = check_binary_avx2;
+    else check_binary = check_binary_sse2;
+#endif
+}
+
+uint32_t crc32c_table[256];
+
+uint32_t crc32c_scalar(uint32_t crc, const char* buf, size_t n) {
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) crc = crc32c_table[(crc ^ (unsigned char)buf[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const char* buf, size_t n) {
+    size_t i = 0;
+#ifdef __x86_64__
+    uint64_t c = ~crc, w;
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&w, buf + i, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = c;
+#else
+    crc = ~crc;
+#endif
+    for (; i < n; i++) crc = _mm_crc32_u8(crc, buf[i]);
+    return ~crc;
+}
+#endif
+
+uint32_t (*crc32c)(uint32_t crc, const char* buf, size_t n) = crc32c_scalar;
+
+void init_crc32c() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[i] = c;
+    }
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc32c = crc32c_sse42;
+#endif
+}
+
+uint32_t gf2_times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++) {
+        if (vec & 1) sum ^= *mat;
+    }
+    return sum;
+}
+
+void gf2_square(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; n++) square[n] = gf2_times(mat, mat[n]);
+}
+
+// Runs the CRC register through len zero bytes without touching them, as in
+// zlib's crc32_combine. This is what lets -j and sparse inputs be digested
+// out of order.
+uint32_t crc32c_shift(uint32_t crc, uint64_t len) {
+    uint32_t even[32], odd[32], row = 1;
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++, row <<= 1) odd[n] = row;
+    gf2_square(even, odd);
+    gf2_square(odd, even);
+    while (len) {
+        gf2_square(even, odd);
+        if (len & 1) crc = gf2_times(even, crc);
+        if (!(len >>= 1)) break;
+        gf2_square(odd, even);
+        if (len & 1) crc = gf2_times(odd, crc);
+        len >>= 1;
+    }
+    return crc;
+}
+
+// CRC32C of a followed by b, given b's length.
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+    return crc32c_shift(crc_a, len_b) ^ crc_b;
+}
+
+uint32_t crc32c_zeros(uint32_t crc, uint64_t len) {
+    return ~crc32c_shift(~crc, len);
+}
+
+// Nothing left to learn once binary has been seen (or with -B), unless the
+// bytes are also being checksummed.
+bool scanning(struct stats* st) {
+    return checksum || (detect_binary && !st->is_binary);
+}
+
+void inspect(struct stats* st, char* buf, size_t n) {
+    if (detect_binary && !st->is_binary) st->is_binary = check_binary(buf, n);
+    if (checksum) st->crc = crc32c(st->crc, buf, n);
+}
+
+// Drops whatever a strategy that then had to give up counted, digests and
+// hole bytes included, since the next one starts over from the same bytes.
+void reset_stats(struct stats* st) {
+    long long start_ns = st->start_ns;
+    memset(st, 0, sizeof(*st));
+    st->start_ns = start_ns;
+}
+
+// Errors that only mean "this fd pair can't do a kernel copy", as opposed to
+// real I/O failures. Only honoured before any byte has moved.
+bool can_fall_back(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+int choose_strategy(int fd_r, int fd_w) {
+    struct stat in, out;
+    if (fstat(fd_r, &in) < 0 || fstat(fd_w, &out) < 0) return RW_LOOP;
+    // pseudo files (procfs, sysfs) report size 0 and don't copy in-kernel
+    if (S_ISREG(in.st_mode) && in.st_size > 0) return S_ISREG(out.st_mode) ? COPY_RANGE : SENDFILE;
+    if (S_ISFIFO(in.st_mode)) return SPLICE;
+    return RW_LOOP;
+}
+
+bool map_input(int fd_r, struct scan_map* map) {
+    struct stat sb;
+    map->addr = NULL;
+    if (fstat(fd_r, &sb) < 0 || (map->pos = lseek(fd_r, 0, SEEK_CUR)) < 0) return false;
+    map->len = sb.st_size;
+    if ((!detect_binary && !checksum) || map->len == 0) return true;
+    map->addr = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd_r, 0);
+    if (map->addr == MAP_FAILED) {
+        map->addr = NULL;
+        return false;
+    }
+    return true;
+}
+
+void scan_mapped(int fd_r, struct scan_map* map, ssize_t n, struct stats* st) {
     char buf[BUF_SIZE];
-    
-    int opt, i, fd_w, fd_r, bytes_written, bytes_read, opt_id, r_cnt, w_cnt, total_bytes, total_bytes_written;
-    bool is_binary = false;
-    
-    opterr = 0;
-    if (getopt(argc, argv, "o:") != -1) {
-        if (optarg == NULL) {
-            fprintf(stderr, "No value provided for flag o\n");
+    off_t end = map->pos + n, mapped = (end > map->len) ? map->len : end;
+    long long t0;
+    ssize_t m;
+
+    if (scanning(st) && map->addr && map->pos < mapped) inspect(st, map->addr + map->pos, mapped - map->pos);
+    // bytes appended since the mapping was made
+    for (map->pos = (map->pos > mapped) ? map->pos : mapped; scanning(st) && map->pos < end; map->pos += m) {
+        t0 = lat_start();
+        m = pread(fd_r, buf, (end - map->pos > BUF_SIZE) ? BUF_SIZE : end - map->pos, map->pos);
+        lat_end(st, LAT_READ, t0, m);
+        if (m <= 0) break;
+        inspect(st, buf, m);
+    }
+    map->pos = end;
+}
+
+void unmap_input(struct scan_map* map) {
+    if (map->addr) munmap(map->addr, map->len);
+}
+
+// Holes only need work where the output already has bytes (preallocated by
+// -j, or an output that wasn't truncated); past its end the next write or
+// ftruncate leaves them unallocated.
+void skip_hole(int fd_w, off_t off, off_t len, off_t out_size, char* outfile, struct stats* st) {
+    static char zeros[BUF_SIZE];
+    off_t end = (off + len < out_size) ? off + len : out_size;
+    long long t0;
+    ssize_t n;
+
+    st->holes += len;
+    // a hole reads back as NUL bytes
+    if (detect_binary) st->is_binary = true;
+    if (checksum) st->crc = crc32c_zeros(st->crc, len);
+    if (off >= end || fallocate(fd_w, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, end - off) == 0) return;
+    for (; off < end; off += n) {
+        st->w_cnt++;
+        t0 = lat_start();
+        n = pwrite(fd_w, zeros, (end - off > BUF_SIZE) ? BUF_SIZE : end - off, off);
+        lat_end(st, LAT_WRITE, t0, n);
+        check_error(fd_w, n, outfile, WRITE);
+    }
+}
+
+// copy_file_range for file to file, sendfile for file to anything else,
+// from the file positions on to EOF. Holes are transfer_sparse's business.
+bool transfer_file(int fd_r, int fd_w, char* outfile, struct stats* st) {
+    struct scan_map map;
+    long long t0;
+    ssize_t n;
+    if (!map_input(fd_r, &map)) return false;
+    do {
+        st->c_cnt++;
+        t0 = lat_start();
+        if (st->strategy == COPY_RANGE) n = copy_file_range(fd_r, NULL, fd_w, NULL, COPY_CHUNK, 0);
+        else n = sendfile(fd_w, fd_r, NULL, COPY_CHUNK);
+        lat_end(st, LAT_COPY, t0, n);
+        if (n < 0 && st->bytes == 0 && can_fall_back(errno)) {
+            unmap_input(&map);
+            return false;
+        }
+        check_error(fd_w, n, outfile, WRITE);
+        scan_mapped(fd_r, &map, n, st);
+        st->bytes += n;
+    } while (n != 0);
+    unmap_input(&map);
+    return true;
+}
+
+// splice for pipe inputs. While binary detection is still running, each chunk
+// is first tee'd into a private pipe and read from there for detection; the
+// tee doesn't consume, so a failed first splice can still fall back.
+bool transfer_pipe(int fd_r, int fd_w, char* infile, char* outfile, struct stats* st) {
+    char buf[BUF_SIZE];
+    int peek[2] = {-1, -1};
+    long long t0;
+    ssize_t n, moved, m;
+    bool ok = true, peeked;
+
+    if (scanning(st) && pipe(peek) < 0) return false;
+    for (;;) {
+        peeked = scanning(st);
+        if (peeked) {
+            st->c_cnt++;
+            t0 = lat_start();
+            n = tee(fd_r, peek[1], PIPE_CHUNK, 0);
+            lat_end(st, LAT_COPY, t0, n);
+            if (n < 0 && st->bytes == 0 && can_fall_back(errno)) {
+                ok = false;
+                break;
+            }
+            check_error(fd_r, n, infile, READ);
+            if (n == 0) break;
+            for (moved = 0; moved < n; moved += m) {
+                st->r_cnt++;
+                t0 = lat_start();
+                m = read(peek[0], buf, (n - moved > BUF_SIZE) ? BUF_SIZE : n - moved);
+                lat_end(st, LAT_READ, t0, m);
+                check_error(fd_r, m, infile, READ);
+                if (scanning(st)) inspect(st, buf, m);
+            }
+        } else {
+            n = PIPE_CHUNK;
+        }
+        for (moved = 0; moved < n; moved += m) {
+            st->c_cnt++;
+            t0 = lat_start();
+            m = splice(fd_r, NULL, fd_w, NULL, n - moved, SPLICE_F_MOVE);
+            lat_end(st, LAT_COPY, t0, m);
+            if (m < 0 && st->bytes == 0 && can_fall_back(errno)) {
+                ok = false;
+                goto done;
+            }
+            check_error(fd_w, m, outfile, WRITE);
+            st->bytes += m;
+            if (m == 0) goto done;
+            // without a peek the chunk size is only an upper bound
+            if (!peeked) break;
+        }
+    }
+done:
+    if (peek[0] >= 0) {
+        close(peek[0]);
+        close(peek[1]);
+    }
+    return ok;
+}
+
+bool uring_setup(struct uring* r, unsigned depth, size_t block_size) {
+    struct io_uring_params p;
+    struct iovec* iov;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (r->fd < 0) return false;
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+    sq = mmap(NULL, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) goto fail;
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) goto fail;
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->depth = depth;
+    r->pending = 0;
+    r->block_size = block_size;
+
+    r->blocks = calloc(depth, sizeof(struct uring_block));
+    iov = calloc(depth, sizeof(struct iovec));
+    if (r->blocks == NULL || iov == NULL || posix_memalign((void**)&r->bufs, 4096, depth * block_size) != 0) goto fail;
+    for (unsigned i = 0; i < depth; i++) {
+        iov[i].iov_base = r->bufs + i * block_size;
+        iov[i].iov_len = block_size;
+    }
+    // pinning can fail against RLIMIT_MEMLOCK; plain READ/WRITE still works
+    r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, depth) == 0;
+    free(iov);
+    return true;
+fail:
+    close(r->fd);
+    return false;
+}
+
+void uring_prep(struct uring* r, int type, int fd, unsigned slot, off_t off) {
+    struct uring_block* b = &r->blocks[slot];
+    unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (type == READ) sqe->opcode = r->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    else sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)(r->bufs + slot * r->block_size + b->done);
+    sqe->len = b->len - b->done;
+    // -1 means "at the file position" for streams
+    sqe->off = (off < 0) ? (__u64)-1 : (__u64)(off + b->done);
+    sqe->buf_index = slot;
+    sqe->user_data = (slot << 1) | (type == WRITE);
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+}
+
+// Reads of block k+1.. overlap the write of block k. Seekable inputs keep
+// every free buffer reading at its own offset and seekable outputs take
+// several writes at once; streams get one read and one write in flight.
+// A limit of -1 copies to EOF, otherwise at most limit bytes.
+bool transfer_uring(int fd_r, int fd_w, off_t limit, char* infile, char* outfile, struct stats* st) {
+    struct uring* r = &ring;
+    struct uring_block* b;
+    struct io_uring_cqe* cqe;
+    struct stat in, out;
+    off_t in_start = 0, out_next = 0, copied = 0;
+    long long next_read = 0, next_write = 0, eof = LLONG_MAX;
+    unsigned reading = 0, writing = 0, head, slot;
+    bool in_seek, out_seek, failed = false, moved = false;
+    long long t0;
+    int res;
+
+    if (fstat(fd_r, &in) < 0 || fstat(fd_w, &out) < 0) return false;
+    in_seek = (S_ISREG(in.st_mode) || S_ISBLK(in.st_mode)) && (in_start = lseek(fd_r, 0, SEEK_CUR)) >= 0;
+    out_seek = S_ISREG(out.st_mode) && !(fcntl(fd_w, F_GETFL) & O_APPEND) && (out_next = lseek(fd_w, 0, SEEK_CUR)) >= 0;
+    for (slot = 0; slot < r->depth; slot++) r->blocks[slot].state = B_FREE;
+    if (limit >= 0) eof = (limit + r->block_size - 1) / r->block_size;
+
+    for (;;) {
+        while (!failed && next_read < eof && (in_seek || reading == 0)) {
+            slot = next_read % r->depth;
+            b = &r->blocks[slot];
+            if (b->state != B_FREE) break;
+            b->k = next_read++;
+            b->state = B_READING;
+            b->done = 0;
+            b->len = r->block_size;
+            if (limit >= 0 && (b->k + 1) * (off_t)r->block_size > limit) b->len = limit - b->k * (off_t)r->block_size;
+            b->off = in_seek ? in_start + b->k * (off_t)r->block_size : -1;
+            uring_prep(r, READ, fd_r, slot, b->off);
+            reading++;
+        }
+        while (!failed && next_write < next_read && (out_seek || writing == 0)) {
+            slot = next_write % r->depth;
+            b = &r->blocks[slot];
+            if (b->state != B_FULL || b->k != next_write) break;
+            next_write++;
+            // reads complete in any order, the digest needs file order
+            if (scanning(st)) inspect(st, r->bufs + slot * r->block_size, b->len);
+            b->state = B_WRITING;
+            b->done = 0;
+            b->off = out_seek ? out_next : -1;
+            out_next += b->len;
+            uring_prep(r, WRITE, fd_w, slot, b->off);
+            writing++;
+        }
+        if (reading + writing == 0) break;
+
+        st->c_cnt++;
+        t0 = lat_start();
+        res = syscall(__NR_io_uring_enter, r->fd, r->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        lat_end(st, LAT_COPY, t0, res);
+        if (res < 0 && errno == EINTR) continue;
+        check_error(res, 0, infile, READ);
+        r->pending = 0;
+
+        head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &r->cqes[head++ & *r->cq_mask];
+            slot = cqe->user_data >> 1;
+            b = &r->blocks[slot];
+            res = cqe->res;
+            if (b->state == B_READING) {
+                if (failed || (res < 0 && !moved && can_fall_back(-res))) {
+                    failed = true;
+                    b->state = B_FREE;
+                    reading--;
+                    continue;
+                }
+                if (res < 0) errno = -res;
+                check_error(fd_r, res, infile, READ);
+                if (res > 0) {
+                    moved = true;
+                    b->done += res;
+                    // a seekable block is only done when full or at EOF
+                    if (in_seek && b->done < b->len) {
+                        uring_prep(r, READ, fd_r, slot, b->off);
+                        continue;
+                    }
+                } else if (b->k + (b->done > 0) < eof) {
+                    eof = b->k + (b->done > 0);
+                }
+                reading--;
+                b->len = b->done;
+                b->state = b->len ? B_FULL : B_FREE;
+            } else {
+                if (res < 0) errno = -res;
+                check_error(fd_w, res, outfile, WRITE);
+                b->done += res;
+                st->bytes += res;
+                copied += res;
+                if (b->done < b->len) {
+                    uring_prep(r, WRITE, fd_w, slot, b->off);
+                    continue;
+                }
+                writing--;
+                b->state = B_FREE;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (failed) return false;
+    if (in_seek) lseek(fd_r, in_start + copied, SEEK_SET);
+    if (out_seek) lseek(fd_w, out_next, SEEK_SET);
+    return true;
+}
+
+void transfer_rw(int fd_r, int fd_w, char* infile, char* outfile, struct stats* st) {
+    static char* buf;
+    int bytes_read, bytes_written, total_bytes_written;
+    long long t0;
+
+    if (buf == NULL && (buf = malloc(rw_block)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+        exit(-1);
+    }
+    st->r_cnt++;
+    for (;;) {
+        t0 = lat_start();
+        bytes_read = read(fd_r, buf, rw_block);
+        lat_end(st, LAT_READ, t0, bytes_read);
+        if (bytes_read == 0) break;
+        st->r_cnt++;
+        check_error(fd_r, bytes_read, infile, READ);
+        if (scanning(st)) inspect(st, buf, bytes_read);
+        bytes_written = 0, total_bytes_written = 0;
+        while (bytes_written < bytes_read) {
+            st->w_cnt++;
+            t0 = lat_start();
+            bytes_written = write(fd_w, buf+total_bytes_written, bytes_read-total_bytes_written);
+            lat_end(st, LAT_WRITE, t0, bytes_written);
+            check_error(fd_w, bytes_written, outfile, WRITE);
+            total_bytes_written += bytes_written;
+        }
+        st->bytes += total_bytes_written;
+    }
+}
+
+// Starts writeback of the window just written and drops the one before it,
+// whose writeback has had a window's worth of time to finish.
+void release_output(int fd_w, off_t off, off_t len, off_t* prev_off, off_t* prev_len) {
+    sync_file_range(fd_w, off, len, SYNC_FILE_RANGE_WRITE);
+    if (*prev_len) {
+        sync_file_range(fd_w, *prev_off, *prev_len, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd_w, *prev_off, *prev_len, POSIX_FADV_DONTNEED);
+    }
+    *prev_off = off;
+    *prev_len = len;
+}
+
+// -M: write regular inputs straight out of a sliding read-only mapping. The
+// input is read ahead one window at a time and a regular output is pushed
+// out of the page cache behind us, so big copies don't evict other caches.
+// A limit of -1 copies to EOF, otherwise at most limit bytes.
+bool transfer_mmap(int fd_r, int fd_w, off_t limit, char* infile, char* outfile, struct stats* st) {
+    struct stat in, out;
+    off_t pos, base, end, stop, out_pos = 0, prev_off = 0, prev_len = 0;
+    off_t page = sysconf(_SC_PAGESIZE);
+    long long t0;
+    ssize_t n, done;
+    char* addr;
+    bool out_reg;
+
+    if (fstat(fd_r, &in) < 0 || !S_ISREG(in.st_mode) || in.st_size == 0 || (pos = lseek(fd_r, 0, SEEK_CUR)) < 0) return false;
+    out_reg = fstat(fd_w, &out) == 0 && S_ISREG(out.st_mode) && (out_pos = lseek(fd_w, 0, SEEK_CUR)) >= 0;
+    stop = (limit >= 0 && pos + limit < in.st_size) ? pos + limit : in.st_size;
+    while (pos < stop) {
+        base = pos & ~(page - 1);
+        end = (base + MMAP_WINDOW < stop) ? base + MMAP_WINDOW : stop;
+        st->c_cnt++;
+        addr = mmap(NULL, end - base, PROT_READ, MAP_SHARED, fd_r, base);
+        if (addr == MAP_FAILED && st->bytes == 0) return false;
+        check_error(addr == MAP_FAILED ? -1 : 0, 0, infile, READ);
+        madvise(addr, end - base, MADV_SEQUENTIAL);
+        madvise(addr, end - base, MADV_WILLNEED);
+        if (end < stop) posix_fadvise(fd_r, end, MMAP_WINDOW, POSIX_FADV_WILLNEED);
+
+        if (scanning(st)) inspect(st, addr + (pos - base), end - pos);
+        for (done = pos - base; done < end - base; done += n) {
+            st->w_cnt++;
+            t0 = lat_start();
+            n = write(fd_w, addr + done, end - base - done);
+            lat_end(st, LAT_WRITE, t0, n);
+            check_error(fd_w, n, outfile, WRITE);
+        }
+        munmap(addr, end - base);
+        if (out_reg) release_output(fd_w, out_pos, end - pos, &prev_off, &prev_len);
+        st->bytes += end - pos;
+        out_pos += end - pos;
+        pos = end;
+    }
+    if (out_reg) release_output(fd_w, out_pos, 0, &prev_off, &prev_len);
+    lseek(fd_r, pos, SEEK_SET);
+    // anything appended since the fstat, and the usual EOF read
+    if (limit < 0) transfer_rw(fd_r, fd_w, infile, outfile, st);
+    return true;
+}
+
+// Where the next data extent at or after off starts and ends, clamped to
+// size. Without SEEK_DATA support all of it is data.
+void find_extent(int fd_r, off_t off, off_t size, off_t* data, off_t* hole) {
+    *hole = size;
+    *data = lseek(fd_r, off, SEEK_DATA);
+    if (*data < 0 && errno == ENXIO) *data = size;
+    else if (*data < 0) *data = off;
+    else if ((*hole = lseek(fd_r, *data, SEEK_HOLE)) < 0 || *hole > size) *hole = size;
+    if (*data > size) *data = size;
+}
+
+off_t range_extent(int fd_r, int fd_w, off_t in_off, off_t len, off_t out_off, char* outfile, struct scan_map* map, struct stats* st) {
+    off_t end = in_off + len, start = in_off;
+    long long t0;
+    ssize_t n;
+
+    map->pos = in_off;
+    while (in_off < end) {
+        st->c_cnt++;
+        t0 = lat_start();
+        n = copy_file_range(fd_r, &in_off, fd_w, &out_off, end - in_off, 0);
+        lat_end(st, LAT_COPY, t0, n);
+        if (n < 0 && st->bytes == 0 && can_fall_back(errno)) return -1;
+        check_error(fd_w, n, outfile, WRITE);
+        if (n == 0) break;
+        scan_mapped(fd_r, map, n, st);
+        st->bytes += n;
+    }
+    return in_off - start;
+}
+
+// pread/pwrite, so -j threads can share the output.
+off_t rw_extent(int fd_r, int fd_w, off_t in_off, off_t len, off_t out_off, char* infile, char* outfile, struct stats* st) {
+    static __thread char* buf;
+    off_t done = 0;
+    long long t0;
+    ssize_t n, m, put;
+
+    if (buf == NULL && (buf = malloc(rw_block)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+        exit(-1);
+    }
+    while (done < len) {
+        st->r_cnt++;
+        t0 = lat_start();
+        n = pread(fd_r, buf, (len - done > (off_t)rw_block) ? rw_block : (size_t)(len - done), in_off + done);
+        lat_end(st, LAT_READ, t0, n);
+        check_error(fd_r, n, infile, READ);
+        if (n == 0) break;
+        if (scanning(st)) inspect(st, buf, n);
+        for (put = 0; put < n; put += m) {
+            st->w_cnt++;
+            t0 = lat_start();
+            m = pwrite(fd_w, buf + put, n - put, out_off + done + put);
+            lat_end(st, LAT_WRITE, t0, m);
+            check_error(fd_w, m, outfile, WRITE);
+        }
+        done += n;
+        st->bytes += n;
+    }
+    return done;
+}
+
+// Copies up to len bytes at in_off to out_off with the engine of
+// st->strategy. Returns how many there were, short only if the input shrank,
+// or -1 if the engine can't copy between these two files.
+off_t copy_extent(int fd_r, int fd_w, off_t in_off, off_t len, off_t out_off, char* infile, char* outfile, struct scan_map* map, struct stats* st) {
+    long long before = st->bytes;
+    bool ok;
+
+    if (st->strategy == COPY_RANGE) return range_extent(fd_r, fd_w, in_off, len, out_off, outfile, map, st);
+    if (st->strategy == RW_LOOP) return rw_extent(fd_r, fd_w, in_off, len, out_off, infile, outfile, st);
+    // the other engines work from the file positions
+    check_error(fd_r, lseek(fd_r, in_off, SEEK_SET) < 0 ? -1 : 0, infile, READ);
+    check_error(fd_w, lseek(fd_w, out_off, SEEK_SET) < 0 ? -1 : 0, outfile, WRITE);
+    if (st->strategy == MMAP) ok = transfer_mmap(fd_r, fd_w, len, infile, outfile, st);
+    else ok = transfer_uring(fd_r, fd_w, len, infile, outfile, st);
+    return ok ? st->bytes - before : -1;
+}
+
+// Copies the data extents of fd_r between *in_off and size to *out_off of
+// fd_w, keeping the holes between them as holes in the output.
+bool copy_extents(int fd_r, int fd_w, off_t* in_off, off_t size, off_t* out_off, char* infile, char* outfile, struct scan_map* map, struct stats* st) {
+    struct stat sb;
+    off_t data, hole, out_size, n;
+
+    check_error(fd_w, fstat(fd_w, &sb), outfile, WRITE);
+    out_size = sb.st_size;
+    while (*in_off < size) {
+        find_extent(fd_r, *in_off, size, &data, &hole);
+        if (data > *in_off) {
+            skip_hole(fd_w, *out_off, data - *in_off, out_size, outfile, st);
+            *out_off += data - *in_off;
+            *in_off = data;
+        }
+        if (data == hole) continue;
+        n = copy_extent(fd_r, fd_w, data, hole - data, *out_off, infile, outfile, map, st);
+        if (n < 0) return false;
+        *in_off += n;
+        *out_off += n;
+        // the input shrank
+        if (n < hole - data) break;
+    }
+    check_error(fd_w, fstat(fd_w, &sb), outfile, WRITE);
+    if (sb.st_size < *out_off) check_error(fd_w, ftruncate(fd_w, *out_off), outfile, WRITE);
+    return true;
+}
+
+// The strategy's own loop, from the file positions on to EOF.
+bool transfer_stream(int fd_r, int fd_w, char* infile, char* outfile, struct stats* st) {
+    switch (st->strategy) {
+        case COPY_RANGE:
+        case SENDFILE: return transfer_file(fd_r, fd_w, outfile, st);
+        case SPLICE: return transfer_pipe(fd_r, fd_w, infile, outfile, st);
+        case URING: return transfer_uring(fd_r, fd_w, -1, infile, outfile, st);
+        case MMAP: return transfer_mmap(fd_r, fd_w, -1, infile, outfile, st);
+        default:
+            transfer_rw(fd_r, fd_w, infile, outfile, st);
+            return true;
+    }
+}
+
+// Regular file to regular file goes extent by extent up to the input's size
+// at open, seeking over the holes, and then on to EOF as a stream in case it
+// grew meanwhile. False if either end can't hold holes or the engine can't
+// copy between the two, with both file positions put back.
+bool transfer_sparse(int fd_r, int fd_w, char* infile, char* outfile, struct stats* st) {
+    struct stat in, out;
+    struct scan_map map = {NULL, 0, 0};
+    off_t in_start, out_start, in_off, out_off;
+    bool ok;
+
+    if (fstat(fd_r, &in) < 0 || !S_ISREG(in.st_mode) || in.st_size == 0 || fstat(fd_w, &out) < 0 ||
+        !S_ISREG(out.st_mode) || (fcntl(fd_w, F_GETFL) & O_APPEND) ||
+        (in_start = lseek(fd_r, 0, SEEK_CUR)) < 0 || (out_start = lseek(fd_w, 0, SEEK_CUR)) < 0) return false;
+    // copy_file_range is the only one that doesn't see the bytes it moves
+    if (st->strategy == COPY_RANGE && !map_input(fd_r, &map)) return false;
+    in_off = in_start, out_off = out_start;
+    ok = copy_extents(fd_r, fd_w, &in_off, in.st_size, &out_off, infile, outfile, &map, st);
+    unmap_input(&map);
+    if (ok) {
+        lseek(fd_r, in_off, SEEK_SET);
+        lseek(fd_w, out_off, SEEK_SET);
+        ok = transfer_stream(fd_r, fd_w, infile, outfile, st);
+    }
+    if (!ok) {
+        lseek(fd_r, in_start, SEEK_SET);
+        lseek(fd_w, out_start, SEEK_SET);
+    }
+    return ok;
+}
+
+// One strategy, extent by extent where both ends allow it and as a stream
+// otherwise. A failed attempt leaves nothing counted.
+bool try_strategy(int strategy, int fd_r, int fd_w, char* infile, char* outfile, struct stats* st) {
+    st->strategy = strategy;
+    if (transfer_sparse(fd_r, fd_w, infile, outfile, st)) return true;
+    reset_stats(st);
+    st->strategy = strategy;
+    if (transfer_stream(fd_r, fd_w, infile, outfile, st)) return true;
+    reset_stats(st);
+    return false;
+}
+
+void wait_writable(int fd) {
+    struct pollfd p = {fd, POLLOUT, 0};
+    poll(&p, 1, -1);
+}
+
+// Writes what out hasn't had yet from the ring. Regular files take all of
+// it; the others are non-blocking and get the rest on their next POLLOUT.
+void write_pending(struct output* out, char* ring, long long in_pos, struct stats* st) {
+    size_t off, len;
+    long long t0;
+    ssize_t n;
+    do {
+        off = out->pos % FANOUT_RING;
+        len = (in_pos - out->pos < (long long)(FANOUT_RING - off)) ? (size_t)(in_pos - out->pos) : FANOUT_RING - off;
+        if (len == 0) return;
+        out->w_cnt++;
+        t0 = lat_start();
+        n = write(out->fd, ring + off, len);
+        lat_end(st, LAT_WRITE, t0, n);
+        if (n < 0 && errno == EAGAIN) return;
+        check_error(out->fd, n, out->name, WRITE);
+        out->pos += n;
+        out->bytes += n;
+    } while (out->is_reg);
+}
+
+// Each block is read once into a ring shared by all outputs. Reading stops
+// while the slowest output is a full ring behind, so a slow reader holds
+// the others up only after FANOUT_RING bytes are queued for it.
+void transfer_fanout(int fd_r, char* infile, struct stats* st) {
+    static char* ring;
+    struct pollfd fds[nout + 1];
+    struct output* polled[nout + 1];
+    long long in_pos = 0, min_pos, t0;
+    bool eof = false;
+    size_t off, len;
+    ssize_t n;
+    int i, nfds;
+
+    if (ring == NULL && (ring = malloc(FANOUT_RING)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+        exit(-1);
+    }
+    for (;;) {
+        min_pos = in_pos;
+        for (i = 0; i < nout; i++) {
+            if (outputs[i].is_reg) write_pending(&outputs[i], ring, in_pos, st);
+            if (outputs[i].pos < min_pos) min_pos = outputs[i].pos;
+        }
+        if (eof && min_pos == in_pos) break;
+        nfds = 0;
+        if (!eof && in_pos - min_pos < FANOUT_RING) {
+            fds[nfds] = (struct pollfd){fd_r, POLLIN, 0};
+            polled[nfds++] = NULL;
+        }
+        for (i = 0; i < nout; i++) {
+            if (outputs[i].is_reg || outputs[i].pos == in_pos) continue;
+            fds[nfds] = (struct pollfd){outputs[i].fd, POLLOUT, 0};
+            polled[nfds++] = &outputs[i];
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            check_error(-1, 0, infile, READ);
+        }
+        for (i = 0; i < nfds; i++) {
+            if (!fds[i].revents) continue;
+            if (polled[i]) {
+                write_pending(polled[i], ring, in_pos, st);
+                continue;
+            }
+            off = in_pos % FANOUT_RING;
+            len = FANOUT_RING - (in_pos - min_pos);
+            if (len > FANOUT_RING - off) len = FANOUT_RING - off;
+            st->r_cnt++;
+            t0 = lat_start();
+            n = read(fd_r, ring + off, len);
+            lat_end(st, LAT_READ, t0, n);
+            check_error(fd_r, n, infile, READ);
+            if (n == 0) eof = true;
+            else if (scanning(st)) inspect(st, ring + off, n);
+            in_pos += n;
+        }
+    }
+    st->bytes = in_pos;
+}
+
+// Writes buf[done..n) to out, waiting out EAGAIN on non-blocking outputs.
+void write_rest(struct output* out, char* buf, ssize_t done, ssize_t n, struct stats* st) {
+    long long t0;
+    ssize_t m;
+    while (done < n) {
+        out->w_cnt++;
+        t0 = lat_start();
+        m = write(out->fd, buf + done, n - done);
+        lat_end(st, LAT_WRITE, t0, m);
+        if (m < 0 && errno == EAGAIN) {
+            wait_writable(out->fd);
+            continue;
+        }
+        check_error(out->fd, m, out->name, WRITE);
+        done += m;
+        out->bytes += m;
+    }
+}
+
+// tee always starts at the head of the pipe, so when an output takes only
+// part of a chunk the rest has to go through user space.
+void tee_output(struct output* out, int from, int spare[2], ssize_t n, struct stats* st) {
+    static char buf[PIPE_CHUNK];
+    ssize_t m, done, got;
+    long long t0;
+
+    for (;;) {
+        out->c_cnt++;
+        t0 = lat_start();
+        m = tee(from, out->fd, n, 0);
+        lat_end(st, LAT_COPY, t0, m);
+        if (m >= 0 || errno != EAGAIN) break;
+        wait_writable(out->fd);
+    }
+    check_error(out->fd, m, out->name, WRITE);
+    out->bytes += m;
+    if (m == n) return;
+    check_error(spare[1], tee(from, spare[1], n, 0), out->name, WRITE);
+    for (got = 0; got < n; got += done) {
+        done = read(spare[0], buf + got, n - got);
+        check_error(spare[0], done, out->name, READ);
+    }
+    write_rest(out, buf, m, n, st);
+}
+
+// Pipe outputs get each chunk without it passing through user space: it is
+// spliced into a staging pipe, tee'd into every pipe output but the last and
+// moved into the last one. Regular file outputs, and binary detection, work
+// from one copy read out of a tee of the staging pipe. Output pipes were
+// grown to FANOUT_RING, which is what bounds how far a slow reader can hold
+// up the others.
+bool transfer_fanout_pipe(int fd_r, char* infile, struct stats* st) {
+    static char buf[PIPE_CHUNK];
+    int stage[2], spare[2], i;
+    struct output* last = NULL;
+    bool copy = scanning(st), ok = true;
+    ssize_t n, m, moved;
+    long long t0;
+
+    for (i = 0; i < nout; i++) {
+        if (outputs[i].is_pipe) last = &outputs[i];
+        else copy = true;
+    }
+    if (pipe(stage) < 0) return false;
+    if (pipe(spare) < 0) {
+        close(stage[0]);
+        close(stage[1]);
+        return false;
+    }
+    for (;;) {
+        st->c_cnt++;
+        t0 = lat_start();
+        n = splice(fd_r, NULL, stage[1], NULL, PIPE_CHUNK, 0);
+        lat_end(st, LAT_COPY, t0, n);
+        if (n < 0 && st->bytes == 0 && can_fall_back(errno)) {
+            ok = false;
+            break;
+        }
+        check_error(fd_r, n, infile, READ);
+        if (n == 0) break;
+        if (copy) {
+            st->c_cnt++;
+            check_error(spare[1], tee(stage[0], spare[1], n, 0), infile, READ);
+            for (moved = 0; moved < n; moved += m) {
+                st->r_cnt++;
+                t0 = lat_start();
+                m = read(spare[0], buf + moved, n - moved);
+                lat_end(st, LAT_READ, t0, m);
+                check_error(spare[0], m, infile, READ);
+            }
+            if (scanning(st)) inspect(st, buf, n);
+            for (i = 0; i < nout; i++) {
+                if (outputs[i].is_reg) write_rest(&outputs[i], buf, 0, n, st);
+            }
+        }
+        for (i = 0; i < nout; i++) {
+            if (outputs[i].is_pipe && &outputs[i] != last) tee_output(&outputs[i], stage[0], spare, n, st);
+        }
+        for (moved = 0; moved < n; moved += m) {
+            last->c_cnt++;
+            t0 = lat_start();
+            m = splice(stage[0], NULL, last->fd, NULL, n - moved, 0);
+            lat_end(st, LAT_COPY, t0, m);
+            if (m < 0 && errno == EAGAIN) {
+                wait_writable(last->fd);
+                m = 0;
+                continue;
+            }
+            check_error(last->fd, m, last->name, WRITE);
+            last->bytes += m;
+        }
+        st->bytes += n;
+    }
+    close(stage[0]);
+    close(stage[1]);
+    close(spare[0]);
+    close(spare[1]);
+    return ok;
+}
+
+// The splice fan-out needs a spliceable input, at least one pipe output and
+// nothing but pipes and regular files among the outputs.
+bool can_splice_fanout(int fd_r) {
+    struct stat in;
+    bool pipe_out = false;
+    if (fstat(fd_r, &in) < 0 || !(S_ISFIFO(in.st_mode) || S_ISREG(in.st_mode))) return false;
+    for (int i = 0; i < nout; i++) {
+        if (!outputs[i].is_pipe && !outputs[i].is_reg) return false;
+        pipe_out |= outputs[i].is_pipe;
+    }
+    return pipe_out;
+}
+
+void transfer(int fd_r, int fd_w, char* infile, char* outfile, struct stats* st) {
+    if (nout > 1) {
+        st->strategy = SPLICE;
+        if (!can_splice_fanout(fd_r) || !transfer_fanout_pipe(fd_r, infile, st)) {
+            reset_stats(st);
+            for (int i = 0; i < nout; i++) outputs[i].bytes = outputs[i].w_cnt = outputs[i].c_cnt = 0;
+            st->strategy = RW_LOOP;
+            transfer_fanout(fd_r, infile, st);
+        }
+        for (int i = 0; i < nout; i++) {
+            st->w_cnt += outputs[i].w_cnt;
+            st->c_cnt += outputs[i].c_cnt;
+        }
+        return;
+    }
+    if (!force_rw) {
+        if (use_mmap && try_strategy(MMAP, fd_r, fd_w, infile, outfile, st)) return;
+        if (use_uring && try_strategy(URING, fd_r, fd_w, infile, outfile, st)) return;
+        if (try_strategy(choose_strategy(fd_r, fd_w), fd_r, fd_w, infile, outfile, st)) return;
+    }
+    try_strategy(RW_LOOP, fd_r, fd_w, infile, outfile, st);
+}
+
+void account_output(struct stats* st) {
+    long long len = st->bytes + st->holes;
+    out_crc = crc32c_combine(out_crc, st->crc, len);
+    out_len += len;
+}
+
+// Reads back what was written, from disk rather than the dirty page cache,
+// and checks it against the digest computed during the copy.
+void verify_output(struct output* out) {
+    struct stat sb;
+    uint32_t crc = 0;
+    long long left = out_len;
+    off_t start = out->start;
+    ssize_t n;
+    char* buf;
+    int fd;
+
+    if (fstat(out->fd, &sb) < 0 || !S_ISREG(sb.st_mode) || start < 0) {
+        fprintf(stderr, "Can't verify %s: not a regular file\n", out->name);
+        // with fan-out the pipes alongside the files are expected
+        if (nout > 1) return;
+        exit(-1);
+    }
+    fdatasync(out->fd);
+    posix_fadvise(out->fd, start, out_len, POSIX_FADV_DONTNEED);
+    fd = open(out->path ? out->path : "/proc/self/fd/1", O_RDONLY);
+    check_error(fd, 0, out->name, ROPEN);
+    buf = malloc(VERIFY_BUF);
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+        exit(-1);
+    }
+    while (left > 0) {
+        n = pread(fd, buf, (left > VERIFY_BUF) ? VERIFY_BUF : left, start);
+        check_error(fd, n, out->name, READ);
+        if (n == 0) break;
+        crc = crc32c(crc, buf, n);
+        start += n, left -= n;
+    }
+    free(buf);
+    check_error(fd, close(fd), out->name, ICLOSE);
+    if (left > 0 || crc != out_crc) {
+        fprintf(stderr, "Verification of %s failed: expected CRC32C %08x over %lld bytes, read back %08x over %lld bytes.\n", out->name, out_crc, out_len, crc, out_len - left);
+        exit(-1);
+    }
+    fprintf(stderr, "Verified %s: CRC32C %08x over %lld bytes.\n", out->name, crc, out_len);
+}
+
+// Copies exactly size bytes of fd_r to offset out_off of fd_w without
+// touching either file position, so any number of these can run at once.
+void transfer_at(int fd_r, int fd_w, off_t size, off_t out_off, char* infile, char* outfile, struct stats* st) {
+    char buf[1];
+    struct scan_map map;
+    off_t in_off = 0, start = out_off;
+    long long t0;
+    ssize_t n;
+    bool ok;
+
+    st->strategy = COPY_RANGE;
+    ok = map_input(fd_r, &map) && copy_extents(fd_r, fd_w, &in_off, size, &out_off, infile, outfile, &map, st);
+    unmap_input(&map);
+    if (!ok) {
+        // pread/pwrite, still skipping the holes
+        reset_stats(st);
+        st->strategy = RW_LOOP;
+        in_off = 0;
+        out_off = start;
+        copy_extents(fd_r, fd_w, &in_off, size, &out_off, infile, outfile, &map, st);
+    }
+    // the terminating read of the sequential loop doubles as a check that
+    // the file didn't grow past the slot reserved for it
+    st->r_cnt++;
+    t0 = lat_start();
+    n = pread(fd_r, buf, 1, size);
+    lat_end(st, LAT_READ, t0, n);
+    check_error(fd_r, n, infile, READ);
+    if (n > 0) {
+        fprintf(stderr, "Can't copy file %s in parallel: it changed size while copying\n", infile);
+        exit(-1);
+    }
+}
+
+void* parallel_worker(void* arg) {
+    int i, fd_r;
+    (void)arg;
+    while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < njobs) {
+        fd_r = open(jobs[i].name, O_RDONLY);
+        check_error(fd_r, 0, jobs[i].name, ROPEN);
+        jobs[i].st.start_ns = now_ns();
+        transfer_at(fd_r, fd_out, jobs[i].size, jobs[i].off, jobs[i].name, outname, &jobs[i].st);
+        jobs[i].st.end_ns = now_ns();
+        check_error(fd_r, close(fd_r), jobs[i].name, ICLOSE);
+    }
+    return NULL;
+}
+
+// procfs/sysfs files claim size 0 but have content
+bool has_hidden_size(char* name) {
+    char c;
+    int fd = open(name, O_RDONLY);
+    bool hidden = fd >= 0 && read(fd, &c, 1) > 0;
+    if (fd >= 0) close(fd);
+    return hidden;
+}
+
+// -j only applies when every offset is known up front: a regular output and
+// named regular inputs. Anything else runs through the sequential loop.
+bool transfer_parallel(char* names[], int n, int nthreads) {
+    struct stat sb;
+    pthread_t* threads;
+    off_t total = 0;
+    int i, err;
+
+    if (fstat(fd_out, &sb) < 0 || !S_ISREG(sb.st_mode)) return false;
+    jobs = calloc(n, sizeof(struct job));
+    threads = calloc(nthreads, sizeof(pthread_t));
+    if (jobs == NULL || threads == NULL) {
+        free(jobs);
+        free(threads);
+        return false;
+    }
+    for (i = 0; i < n; i++) {
+        if (strcmp(names[i], "-") == 0 || stat(names[i], &sb) < 0 || !S_ISREG(sb.st_mode) ||
+            (sb.st_size == 0 && has_hidden_size(names[i]))) {
+            free(jobs);
+            free(threads);
+            return false;
+        }
+        jobs[i].name = names[i];
+        jobs[i].size = sb.st_size;
+        jobs[i].off = total;
+        total += sb.st_size;
+    }
+    // preallocation is only an optimization, but the output must be at its
+    // full size before the workers start, so none of them ever extends it
+    if (total > 0 && fallocate(fd_out, 0, 0, total) < 0) check_error(fd_out, ftruncate(fd_out, total), outname, WRITE);
+
+    njobs = n;
+    if (nthreads > n) nthreads = n;
+    for (i = 0; i < nthreads; i++) {
+        if ((err = pthread_create(&threads[i], NULL, parallel_worker, NULL)) != 0) {
+            fprintf(stderr, "Can't create thread: %s\n", strerror(err));
             exit(-1);
         }
-        outfile = optarg;
+    }
+    for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+    check_error(fd_out, lseek(fd_out, total, SEEK_SET), outname, WRITE);
+    for (i = 0; i < n; i++) {
+        report(jobs[i].name, outname, &jobs[i].st);
+        account_output(&jobs[i].st);
+    }
+    free(jobs);
+    free(threads);
+    return true;
+}
+
+long parse_size(char* s, int flag) {
+    char* end;
+    errno = 0;
+    long num = strtol(s, &end, 10);
+    if (end == s || num <= 0 || errno == ERANGE) {
+        fprintf(stderr, "Invalid value %s for flag %c\n", s, flag);
+        exit(-1);
+    }
+    switch (*end) {
+        case 'k': case 'K': num <<= 10; end++; break;
+        case 'm': case 'M': num <<= 20; end++; break;
+        case 'g': case 'G': num <<= 30; end++; break;
+    }
+    if (*end != '\0') {
+        fprintf(stderr, "Invalid value %s for flag %c\n", s, flag);
+        exit(-1);
+    }
+    return num;
+}
+
+int main(int argc, char *argv[]) {
+    struct stat sb;
+    char* inname;
+    struct stats st;
+    int nthreads = 1;
+    unsigned depth = URING_DEPTH;
+    size_t block_size = URING_BLOCK;
+
+    int opt, i, j, fd_w, fd_r, opt_id;
+    size_t names_len = 1;
+    struct option long_opts[] = {
+        {"checksum", no_argument, NULL, 'c'},
+        {"verify", no_argument, NULL, 'V'},
+        {"json", optional_argument, NULL, 'J'},
+        {NULL, 0, NULL, 0}
+    };
+
+    outputs = calloc(argc, sizeof(struct output));
+    if (outputs == NULL) {
+        fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+        exit(-1);
+    }
+    opterr = 0;
+    while ((opt = getopt_long(argc, argv, "o:BMRUq:b:j:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                outputs[nout].name = outputs[nout].path = optarg;
+                nout++;
+                break;
+            case 'B':
+                detect_binary = false;
+                break;
+            case 'M':
+                use_mmap = true;
+                break;
+            case 'R':
+                force_rw = true;
+                break;
+            case 'U':
+                use_uring = true;
+                break;
+            case 'q':
+                depth = parse_size(optarg, opt);
+                break;
+            case 'b':
+                block_size = rw_block = parse_size(optarg, opt);
+                break;
+            case 'j':
+                nthreads = parse_size(optarg, opt);
+                break;
+            case 'V':
+                verify = true;
+                // fall through
+            case 'c':
+                checksum = true;
+                break;
+            case 'J':
+                json_out = stderr;
+                if (optarg && (json_out = fdopen(parse_size(optarg, opt), "w")) == NULL) {
+                    fprintf(stderr, "Can't write telemetry to fd %s: %s\n", optarg, strerror(errno));
+                    exit(-1);
+                }
+                break;
+            default:
+                if (optopt == 'o' || optopt == 'q' || optopt == 'b' || optopt == 'j') fprintf(stderr, "No value provided for flag %c\n", optopt);
+                else fprintf(stderr, "Unknown flag %c\n", optopt);
+                exit(-1);
+        }
     }
     opt_id = optind;
-    
-    fd_w = STDOUT_FILENO;
-    if (outfile) {
-        fd_w = open(outfile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
-        check_error(fd_w, 0, outfile, WOPEN);
+    init_check_binary();
+    init_crc32c();
+    // without io_uring (old kernel, seccomp) the other strategies apply
+    if (use_uring) use_uring = uring_setup(&ring, depth, block_size);
+
+    if (nout == 0) {
+        outputs[0].name = "<standard output>";
+        outputs[0].fd = STDOUT_FILENO;
+        nout = 1;
+    }
+    for (i = 0; i < nout; i++) {
+        if (outputs[i].path) {
+            outputs[i].fd = open(outputs[i].path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+            check_error(outputs[i].fd, 0, outputs[i].path, WOPEN);
+        }
+        outputs[i].start = lseek(outputs[i].fd, 0, SEEK_CUR);
+        if (fstat(outputs[i].fd, &sb) == 0) {
+            outputs[i].is_reg = S_ISREG(sb.st_mode);
+            outputs[i].is_pipe = S_ISFIFO(sb.st_mode);
+        }
+        // fan-out must not block on one output while another could be written
+        if (nout > 1 && !outputs[i].is_reg) {
+            fcntl(outputs[i].fd, F_SETFL, fcntl(outputs[i].fd, F_GETFL) | O_NONBLOCK);
+            if (outputs[i].is_pipe) fcntl(outputs[i].fd, F_SETPIPE_SZ, FANOUT_RING);
+        }
+        names_len += strlen(outputs[i].name) + 2;
+    }
+    fd_w = outputs[0].fd;
+    outname = outputs[0].name;
+    if (nout > 1) {
+        outname = malloc(names_len);
+        if (outname == NULL) {
+            fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+            exit(-1);
+        }
+        strcpy(outname, outputs[0].name);
+        for (i = 1; i < nout; i++) strcat(strcat(outname, ", "), outputs[i].name);
     }
-    
+
     if (opt_id == argc) argv[--opt_id] = "-";
-    
+
+    fd_out = fd_w;
+    if (nthreads > 1 && nout == 1 && outputs[0].path && transfer_parallel(argv + opt_id, argc - opt_id, nthreads)) opt_id = argc;
+
     for (i = opt_id; i < argc; i++) {
         if (strcmp(argv[i], "-") == 0) fd_r = STDIN_FILENO;
         else fd_r = open(argv[i], O_RDONLY);
         check_error(fd_r, 0, argv[i], ROPEN);
-        r_cnt = 1, w_cnt = 0, total_bytes = 0, is_binary = false;
-        while ((bytes_read = read(fd_r, buf, BUF_SIZE)) != 0) {
-            r_cnt++;
-            check_error(fd_r, bytes_read, argv[i], READ);
-            if (!is_binary) is_binary = check_binary(buf, bytes_read);
-            bytes_written = 0, total_bytes_written = 0;
-            while (bytes_written < bytes_read) {
-                w_cnt++;
-                bytes_written = write(fd_w, buf+total_bytes_written, bytes_read-total_bytes_written);
-                check_error(fd_w, bytes_written, outfile, WRITE);
-                total_bytes_written += bytes_written;
-            }
-            total_bytes += total_bytes_written;
-        }
-        if (!fd_r && !outfile) report("<standard input>", "<standard output>", total_bytes, r_cnt, w_cnt, is_binary);
-        else if (!fd_r) report("<standard input>", outfile, total_bytes, r_cnt, w_cnt, is_binary);
-        else if (!outfile) report(argv[i], "<standard output>", total_bytes, r_cnt, w_cnt, is_binary);
-        else report(argv[i], outfile, total_bytes, r_cnt, w_cnt, is_binary);
+        inname = fd_r ? argv[i] : "<standard input>";
+        memset(&st, 0, sizeof(st));
+        for (j = 0; j < nout; j++) outputs[j].pos = outputs[j].bytes = outputs[j].w_cnt = outputs[j].c_cnt = 0;
+        st.start_ns = now_ns();
+        transfer(fd_r, fd_w, inname, outname, &st);
+        st.end_ns = now_ns();
+        report(inname, outname, &st);
+        account_output(&st);
         if (fd_r) check_error(fd_r, close(fd_r), argv[i], OCLOSE);
     }
-    if (outfile) check_error(fd_w, close(fd_w), outfile, ICLOSE);
+    if (checksum) fprintf(stderr, "CRC32C of %s: %08x over %lld bytes\n", outname, out_crc, out_len);
+    for (i = 0; verify && i < nout; i++) verify_output(&outputs[i]);
+    for (i = 0; i < nout; i++) {
+        if (outputs[i].path) check_error(outputs[i].fd, close(outputs[i].fd), outputs[i].path, ICLOSE);
+    }
+    if (use_uring) close(ring.fd);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Copies a sparse file across filesystems, from the build tree to tmpfs, so
+# copy_file_range fails with EXDEV and kitty falls back to another strategy,
+# and checks that --verify still agrees with the digest taken on the way and
+# that the holes made it across.
+# Usage: test_sparse.sh KITTY [TMPFS_DIR]
+
+kitty=$1
+shm=${2:-/dev/shm}
+img=sparse_test.img
+out=$shm/kitty_sparse_test.$$
+
+if [ ! -d "$shm" ] || [ "$(stat -c %d .)" = "$(stat -c %d "$shm")" ]; then
+    echo "no second filesystem to copy to, skipping"
+    exit 77
+fi
+trap 'rm -f "$img" "$out"' EXIT
+
+rm -f "$img"
+truncate -s 50M "$img"
+printf 'hello' | dd of="$img" bs=1 seek=10485760 conv=notrunc 2>/dev/null
+printf 'tail' | dd of="$img" bs=1 seek=30000000 conv=notrunc 2>/dev/null
+
+status=0
+for flags in "" "-R" "-M" "-U" "-j 2"; do
+    if [ "$flags" = "-j 2" ]; then set -- "$img" "$img"; else set -- "$img"; fi
+    if ! "$kitty" $flags --verify -o "$out" "$@" 2>log.$$; then
+        echo "kitty $flags --verify $*:"
+        cat log.$$
+        status=1
+    elif [ $(($(stat -c %b "$out") * 512)) -ge 1048576 ]; then
+        echo "kitty $flags -o $out $*: holes were written out"
+        status=1
+    fi
+    rm -f log.$$ "$out"
+done
+exit $status
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Checksums a file with every other MiB dropped from the page cache, so the
+# io_uring reads of -U complete out of order, and checks the CRC32C matches
+# the one the plain read/write loop takes.
+# Usage: test_uring_crc.sh KITTY
+
+kitty=$1
+img=uring_crc_test.img
+out=uring_crc_test.out
+
+trap 'rm -f "$img" "$out"' EXIT
+
+head -c 64M /dev/urandom > "$img"
+sync "$img" 2>/dev/null || sync
+# dd's nocache drops the pages it has just read
+if ! dd if="$img" of=/dev/null iflag=nocache bs=1M count=1 2>/dev/null; then
+    echo "dd can't drop pages from the cache, skipping"
+    exit 77
+fi
+
+crc() {
+    "$kitty" "$@" --checksum -o "$out" "$img" 2>&1 | sed -n "s/^CRC32C of $img: //p"
+}
+
+want=$(crc -R)
+status=0
+for run in 1 2 3; do
+    cat "$img" > /dev/null
+    i=1
+    while [ $i -lt 64 ]; do
+        dd if="$img" of=/dev/null iflag=nocache bs=1M skip=$i count=1 2>/dev/null
+        i=$((i + 2))
+    done
+    got=$(crc -U -q 16 -b 1048576)
+    if [ "$got" != "$want" ]; then
+        echo "kitty -U --checksum, run $run: CRC32C $got, -R gave $want"
+        status=1
+    fi
+done
+exit $status
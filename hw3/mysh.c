@@ -1,11 +1,14 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -23,6 +26,38 @@
 #define CHDIR 12
 #define PID 13
 #define GETLINE 14
+#define PIPE 15
+
+// One redirection of a pipeline stage: fd is replaced by path opened with flags.
+struct redir {
+    int fd;
+    int flags;
+    char *path;
+};
+
+// One command of a pipeline. Its stdin and stdout are the neighbouring pipes
+// unless a redirection says otherwise.
+struct stage {
+    char **argv;
+    int argc;
+    struct redir *redirs;
+    int nRedirs;
+};
+
+// Command name to the absolute path PATH lookup found for it, like bash's
+// hash table; open addressing with linear probing.
+struct cmdCache {
+    struct cmdEntry {
+        char *name;
+        char *path;
+        unsigned long hits;
+    } *slots;
+    size_t cap, count;
+    unsigned long hits, misses;
+    char *pathVar; // PATH the entries were found with
+};
+
+extern char **environ;
 
 int run_cd(char *path);
 
@@ -30,12 +65,32 @@ void check_error(int fd, int n, char *s, int type, int return_code);
 
 bool check_pound(const char *line);
 
-char **parse_cmd(char *line, mode_t **redirIn, mode_t **redirOut, int **mode, int *cmdLength, int *redirLoc);
+struct stage *parse_cmd(char *line, int *nStages);
+
+int parse_stage(char *segment, struct stage *stage);
+
+void free_cmd(struct stage *stages, int nStages);
+
+int run_cmd(struct stage *stages, int nStages);
 
-int run_cmd(char **parsedCmd, mode_t *redirIn, mode_t *redirOut, int *mode, int cmdLength, int redirLoc);
+int open_redirs(struct stage *stage, int *fds);
+
+pid_t spawn_stage(struct stage *stage, int *fds, int in, int out);
+
+int spawn_script(pid_t *pid, char *path, posix_spawn_file_actions_t *fa, char **argv);
 
 int run_pwd();
 
+char *resolve_cmd(char *name);
+
+struct cmdEntry *find_cmd(char *name);
+
+void forget_cmd(char *name);
+
+void clear_cmds();
+
+int run_hash(char *arg);
+
 void run_exit(char *code, int return_code);
 
 void print_time_info(struct timeval *result, struct rusage *ru);
@@ -46,11 +101,12 @@ void get_time(struct timeval *time);
 
 int shell_redirect_fd = -1;
 char* shell_redirect;
+struct cmdCache cmdCache;
 
 int main(int argc, char *argv[]) {
     FILE *infile;
     if (argc > 1) {
-        shell_redirect_fd = open(argv[1], O_RDONLY);
+        shell_redirect_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
         shell_redirect = argv[1];
         check_error(shell_redirect_fd, 0, argv[1], ROPEN, 0);
         infile = fdopen(shell_redirect_fd, "r");
@@ -68,142 +124,272 @@ int main(int argc, char *argv[]) {
     while ((byteRead = getline(&line, &lineLength, infile)) != -1) {
         check_error(byteRead, 0, "", GETLINE, 0);
         if (check_pound(line)) continue;
-        int *mode, redirLoc = 0, cmdLength = 0;
-        mode_t *redirIn, *redirOut;
-        char **parsedCmd = parse_cmd(line, &redirIn, &redirOut, &mode, &cmdLength, &redirLoc);
-        if (parsedCmd == NULL) continue;
-        if (strcmp(parsedCmd[0], "cd") == 0) {
+        int nStages = 0;
+        struct stage *stages = parse_cmd(line, &nStages);
+        if (stages == NULL) continue;
+        char **parsedCmd = stages[0].argv;
+        // builtins only run in the shell itself when they are the whole line
+        if (nStages == 1 && strcmp(parsedCmd[0], "cd") == 0) {
             return_code = run_cd(parsedCmd[1]);
-            free(redirIn); free(redirOut); free(mode); free(parsedCmd);
+            free_cmd(stages, nStages);
             continue;
         }
-        if (redirLoc == 0 && strcmp(parsedCmd[0], "pwd") == 0) {
+        if (nStages == 1 && stages[0].nRedirs == 0 && strcmp(parsedCmd[0], "pwd") == 0) {
             return_code = run_pwd();
-            free(redirIn); free(redirOut); free(mode); free(parsedCmd);
+            free_cmd(stages, nStages);
+            continue;
+        }
+        if (nStages == 1 && stages[0].nRedirs == 0 && strcmp(parsedCmd[0], "hash") == 0) {
+            return_code = run_hash(parsedCmd[1]);
+            free_cmd(stages, nStages);
             continue;
         }
-        if (strcmp(parsedCmd[0], "exit") == 0) {
+        if (nStages == 1 && strcmp(parsedCmd[0], "exit") == 0) {
             run_exit(parsedCmd[1], return_code);
         }
-        return_code = run_cmd(parsedCmd, redirIn, redirOut, mode, cmdLength, redirLoc);
-        free(redirIn); free(redirOut); free(mode); free(parsedCmd);
+        return_code = run_cmd(stages, nStages);
+        free_cmd(stages, nStages);
     }
     return 0;
 }
 
-int run_cmd(char **parsedCmd, mode_t *redirIn, mode_t *redirOut, int *mode, int cmdLength, int redirLoc) {
-    pid_t w;
-    struct rusage ru;
-    struct timeval start, end, result;
-    int fd = -1, return_code = 0;
-    int wstatus, i;
-    int redirLength = (redirLoc != 0) ? cmdLength - redirLoc : 0;
+// Runs a pipeline of nStages commands. Each stage is started with
+// posix_spawn(), which vforks, so the shell's memory is never copied;
+// its pipe ends and redirections are put in place by dup2 file actions.
+// Only a pwd stage, which has to run the builtin in the child, is forked.
+// Each stage is reported as it was before, with its own rusage, in
+// pipeline order; the last stage's status is the return code.
+int run_cmd(struct stage *stages, int nStages) {
+    pid_t w, *pids = calloc(nStages, sizeof(pid_t));
+    int *wstatus = calloc(nStages, sizeof(int));
+    struct rusage *ru = calloc(nStages, sizeof(struct rusage));
+    struct timeval start, *end = calloc(nStages, sizeof(struct timeval)), result;
+    int pipefd[2], in = -1, out, return_code = 0, running = 0, i, fds[3];
 
+    if (pids == NULL || wstatus == NULL || ru == NULL || end == NULL) {
+        fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // a forked pwd stage would otherwise print the shell's pending output again
+    fflush(stdout);
     get_time(&start);
-    switch (fork()) {
-        case -1: // fail
-            perror("fork failed");
-            exit(EXIT_FAILURE);
-        case 0: // child
-            if (shell_redirect_fd != -1) check_error(close(shell_redirect_fd), 0, shell_redirect, ICLOSE, 0);
-            for (i = 0; i < redirLength; i++) {
-                if (mode[i] & READ) {
-                    fd = open(parsedCmd[redirLoc + i], redirIn[i]);
-                    check_error(fd, 0, parsedCmd[redirLoc + i], ROPEN, 1);
-                    check_error(dup2(fd, STDIN_FILENO), 0, parsedCmd[redirLoc + i], DUP, 1);
-                    check_error(close(fd), 0, parsedCmd[redirLoc + i], ICLOSE, 1);
-                }
-                if (mode[i] & WRITE) {
-                    fd = open(parsedCmd[redirLoc + i], redirOut[i], 0666);
-                    check_error(fd, 0, parsedCmd[redirLoc + i], WOPEN, 1);
-                    if (mode[i] & ERROR) check_error(dup2(fd, STDERR_FILENO), 0, parsedCmd[redirLoc + i], DUP, 1);
-                    else check_error(dup2(fd, STDOUT_FILENO), 0, parsedCmd[redirLoc + i], DUP, 1);
-                    check_error(close(fd), 0, parsedCmd[redirLoc + i], OCLOSE, 1);
-                }
-            }
-            if (strcmp(parsedCmd[0], "pwd") == 0) {
-                run_pwd();
-                exit(EXIT_SUCCESS);
+    for (i = 0; i < nStages; i++) {
+        out = -1;
+        if (i < nStages - 1) {
+            check_error(pipe2(pipefd, O_CLOEXEC), 0, "", PIPE, 0);
+            out = pipefd[1];
+        }
+        if (open_redirs(&stages[i], fds) < 0) {
+            pids[i] = -1;
+            wstatus[i] = 1 << 8; // as if the child had failed the open
+            get_time(&end[i]);
+        } else {
+            pids[i] = spawn_stage(&stages[i], fds, in, out);
+            if (pids[i] < 0) {
+                wstatus[i] = 127 << 8; // as if the child had failed the exec
+                get_time(&end[i]);
             } else {
-                if (redirLoc) parsedCmd[redirLoc] = NULL;
-                check_error(execvp(parsedCmd[0], parsedCmd), 0, parsedCmd[0], EXEC, 127);
+                running++;
             }
-            break;
-        default: // parent
-            w = wait3(&wstatus, 0, &ru);
-            check_error(w, 0, "", PID, 0);
-            get_time(&end);
-            timersub(&end, &start, &result);
-            print_info(w, wstatus, &return_code);
-            print_time_info(&result, &ru);
-            break;
+            for (int fd = 0; fd < 3; fd++) {
+                if (fds[fd] != -1) close(fds[fd]);
+            }
+        }
+        if (in != -1) close(in);
+        if (out != -1) close(out);
+        in = (i < nStages - 1) ? pipefd[0] : -1;
+    }
+
+    while (running > 0) {
+        int status;
+        struct rusage usage;
+        w = wait3(&status, 0, &usage);
+        check_error(w, 0, "", PID, 0);
+        for (i = 0; i < nStages && pids[i] != w; i++);
+        if (i == nStages) continue;
+        wstatus[i] = status;
+        ru[i] = usage;
+        get_time(&end[i]);
+        running--;
+    }
+    // a stage that never started is still reported, with pid -1
+    for (i = 0; i < nStages; i++) {
+        timersub(&end[i], &start, &result);
+        print_info(pids[i], wstatus[i], &return_code);
+        print_time_info(&result, &ru[i]);
     }
+    free(pids); free(wstatus); free(ru); free(end);
     return return_code;
 }
 
-char **parse_cmd(char *line, mode_t **redirIn, mode_t **redirOut, int **mode, int *cmdLength, int *redirLoc) {
-    char **parsedCmd = malloc(BUFSIZ * sizeof(char));
-    if (parsedCmd == NULL) {
+// Opens a stage's redirections in the shell, left to right as the child
+// used to, so a failure is reported against the file. fds[n] is what fd n
+// becomes, or -1 if it is left alone; all are close-on-exec.
+int open_redirs(struct stage *stage, int *fds) {
+    int i, fd;
+    fds[0] = fds[1] = fds[2] = -1;
+    for (i = 0; i < stage->nRedirs; i++) {
+        struct redir *r = &stage->redirs[i];
+        fd = open(r->path, r->flags | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            if (r->fd == STDIN_FILENO)
+                fprintf(stderr, "Can't open file %s for reading: %s\n", r->path, strerror(errno));
+            else
+                fprintf(stderr, "Can't open file %s for writing: %s\n", r->path, strerror(errno));
+            for (fd = 0; fd < 3; fd++) {
+                if (fds[fd] != -1) close(fds[fd]);
+            }
+            return -1;
+        }
+        if (fds[r->fd] != -1) close(fds[r->fd]);
+        fds[r->fd] = fd;
+    }
+    return 0;
+}
+
+// Starts one stage with in/out as its stdin/stdout (-1 to inherit the
+// shell's), overridden by its own redirections in fds.
+pid_t spawn_stage(struct stage *stage, int *fds, int in, int out) {
+    posix_spawn_file_actions_t fa;
+    pid_t pid;
+    int err = ENOENT, fd, src[3] = {in, out, -1};
+    char *path;
+
+    for (fd = 0; fd < 3; fd++) {
+        if (fds[fd] != -1) src[fd] = fds[fd];
+    }
+    if (strcmp(stage->argv[0], "pwd") == 0) {
+        switch (pid = fork()) {
+            case -1:
+                perror("fork failed");
+                exit(EXIT_FAILURE);
+            case 0:
+                for (fd = 0; fd < 3; fd++) {
+                    if (src[fd] != -1) check_error(dup2(src[fd], fd), 0, "", DUP, 1);
+                }
+                run_pwd();
+                exit(EXIT_SUCCESS);
+            default:
+                return pid;
+        }
+    }
+    posix_spawn_file_actions_init(&fa);
+    for (fd = 0; fd < 3; fd++) {
+        if (src[fd] != -1) posix_spawn_file_actions_adddup2(&fa, src[fd], fd);
+    }
+    if ((path = resolve_cmd(stage->argv[0])) != NULL)
+        err = posix_spawn(&pid, path, &fa, NULL, stage->argv, environ);
+    // the cached file is gone; look the name up once more
+    if (err == ENOENT && path != NULL && path != stage->argv[0]) {
+        forget_cmd(stage->argv[0]);
+        if ((path = resolve_cmd(stage->argv[0])) != NULL)
+            err = posix_spawn(&pid, path, &fa, NULL, stage->argv, environ);
+    }
+    // unlike execvp(), posix_spawn() won't run a script without a #! line
+    if (err == ENOEXEC) err = spawn_script(&pid, path, &fa, stage->argv);
+    posix_spawn_file_actions_destroy(&fa);
+    if (err != 0) {
+        fprintf(stderr, "Can't exec %s: %s\n", stage->argv[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+// Runs path with /bin/sh, passing argv's arguments on, the way execvp()
+// falls back for a file the kernel can't execute.
+int spawn_script(pid_t *pid, char *path, posix_spawn_file_actions_t *fa, char **argv) {
+    int argc = 0, err;
+    char **shArgv;
+
+    while (argv[argc] != NULL) argc++;
+    if ((shArgv = calloc(argc + 2, sizeof(char *))) == NULL) {
         fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
-        return parsedCmd;
+        exit(EXIT_FAILURE);
     }
-    char *token, *delim = " \r\n";
-    int i = 0, m = 0, cnt = 0;
-    char *tmp = malloc(sizeof(line));
-    char *tmp_addr = tmp;
-    if (tmp == NULL) {
+    shArgv[0] = "/bin/sh";
+    shArgv[1] = path;
+    memcpy(shArgv + 2, argv + 1, argc * sizeof(char *)); // with the NULL
+    err = posix_spawn(pid, "/bin/sh", fa, NULL, shArgv, environ);
+    free(shArgv);
+    return err;
+}
+
+// Splits line at each '|' into the stages of a pipeline. Returns NULL for
+// a blank line or an empty stage.
+struct stage *parse_cmd(char *line, int *nStages) {
+    char *segment;
+    int cnt = 1, i = 0, err;
+    for (char *c = line; *c; c++) {
+        if (*c == '|') cnt++;
+    }
+    struct stage *stages = calloc(cnt, sizeof(struct stage));
+    if (stages == NULL) {
         fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
         return NULL;
     }
-    strcpy(tmp, line);
-    while ((strtok_r(tmp, delim, &tmp))) cnt++;
-    free(tmp_addr);
-    *redirIn = malloc(cnt * sizeof(mode_t));
-    *redirOut = malloc(cnt * sizeof(mode_t));
-    *mode = malloc(cnt * sizeof(int));
-    if (*redirIn == NULL || *redirOut == NULL || *mode == NULL) {
+    // strsep rather than strtok so "a || b" shows up as an empty stage
+    while ((segment = strsep(&line, "|")) != NULL) {
+        if ((err = parse_stage(segment, &stages[i])) < 0 || stages[i].argc == 0) {
+            if (err == 0 && (cnt > 1 || stages[i].nRedirs > 0))
+                fprintf(stderr, "Syntax error: empty command in pipeline\n");
+            free_cmd(stages, i + 1);
+            return NULL;
+        }
+        i++;
+    }
+    *nStages = cnt;
+    return stages;
+}
+
+// Splits one stage into its arguments and its <, >, >>, 2> and 2>>
+// redirections. The file name may be attached or the next word.
+int parse_stage(char *segment, struct stage *stage) {
+    char *token, *delim = " \t\r\n", *tmp;
+    int cnt = 0;
+    for (tmp = segment; *tmp; tmp++) {
+        if (strchr(delim, *tmp) != NULL) cnt++;
+    }
+    stage->argv = malloc((cnt + 2) * sizeof(char *));
+    stage->redirs = malloc((cnt + 1) * sizeof(struct redir));
+    if (stage->argv == NULL || stage->redirs == NULL) {
         fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
-        return NULL;
+        return -1;
     }
-    cnt = 0;
-    while ((token = strtok_r(line, delim, &line))) {
+    while ((token = strtok_r(segment, delim, &segment))) {
+        struct redir *r = &stage->redirs[stage->nRedirs];
         if (token[0] == '<') { // <
-            (*redirIn)[cnt] = O_RDONLY;
-            m |= READ;
-            if (*redirLoc == 0) *redirLoc = i;
-            parsedCmd[i++] = token + 1;
-            (*mode)[cnt] = m;
-        } else if (token[0] == '>') {
-            if (token[1] == '>') { // >>
-                (*redirOut)[cnt] = O_WRONLY | O_CREAT | O_APPEND;
-                parsedCmd[i++] = token + 2;
-            } else { // >
-                (*redirOut)[cnt] = O_WRONLY | O_CREAT | O_TRUNC;
-                parsedCmd[i++] = token + 1;
-            }
-            if (*redirLoc == 0) *redirLoc = i - 1;
-            m |= WRITE;
-            (*mode)[cnt] = m;
-        } else if (token[0] == '2') {
-            if (token[2] == '>') { // 2>>
-                (*redirOut)[cnt] = O_WRONLY | O_CREAT | O_APPEND;
-                parsedCmd[i++] = token + 3;
-            } else { // 2>
-                (*redirOut)[cnt] = O_WRONLY | O_CREAT | O_TRUNC;
-                parsedCmd[i++] = token + 2;
+            r->fd = STDIN_FILENO;
+            r->flags = O_RDONLY;
+            r->path = token + 1;
+        } else if (token[0] == '>' || strncmp(token, "2>", 2) == 0) {
+            r->fd = (token[0] == '2') ? STDERR_FILENO : STDOUT_FILENO;
+            r->path = token + ((token[0] == '2') ? 2 : 1);
+            if (r->path[0] == '>') { // >> or 2>>
+                r->flags = O_WRONLY | O_CREAT | O_APPEND;
+                r->path++;
+            } else { // > or 2>
+                r->flags = O_WRONLY | O_CREAT | O_TRUNC;
             }
-            if (*redirLoc == 0) *redirLoc = i - 1;
-            m |= ERROR;
-            (*mode)[cnt] = m;
         } else {
-            parsedCmd[i++] = token;
-            cnt--;
+            stage->argv[stage->argc++] = token;
+            continue;
+        }
+        if (r->path[0] == '\0' && (r->path = strtok_r(segment, delim, &segment)) == NULL) {
+            fprintf(stderr, "Syntax error: missing file name after %s\n", token);
+            return -1;
         }
-        cnt++;
+        stage->nRedirs++;
+    }
+    stage->argv[stage->argc] = NULL;
+    return 0;
+}
+
+void free_cmd(struct stage *stages, int nStages) {
+    for (int i = 0; i < nStages; i++) {
+        free(stages[i].argv);
+        free(stages[i].redirs);
     }
-    parsedCmd[i] = NULL;
-    *cmdLength = i;
-    return parsedCmd;
+    free(stages);
 }
 
 int run_cd(char *path) {
@@ -222,6 +408,138 @@ int run_pwd() {
     return 0;
 }
 
+// The file name should be exec'ed under: name itself if it has a '/',
+// otherwise the first executable regular file in PATH, remembered until
+// PATH changes. Names found through a relative PATH entry aren't cached,
+// since they depend on the current directory. NULL if there is none.
+char *resolve_cmd(char *name) {
+    static char *relPath;
+    struct cmdEntry *e;
+    struct stat sb;
+    char *pathVar = getenv("PATH"), *dir, *end, *full;
+    size_t nameLen = strlen(name), dirLen;
+
+    if (strchr(name, '/') != NULL) return name;
+    if (pathVar == NULL) pathVar = "/bin:/usr/bin";
+    if (cmdCache.pathVar == NULL || strcmp(cmdCache.pathVar, pathVar) != 0) {
+        clear_cmds();
+        cmdCache.pathVar = strdup(pathVar);
+    }
+    if ((e = find_cmd(name)) != NULL && e->name != NULL) {
+        cmdCache.hits++;
+        e->hits++;
+        return e->path;
+    }
+    cmdCache.misses++;
+    for (dir = pathVar;; dir = end + 1) {
+        end = strchrnul(dir, ':');
+        dirLen = end - dir;
+        full = malloc(dirLen + nameLen + 3);
+        if (full == NULL) {
+            fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        // an empty entry means the current directory
+        if (dirLen == 0) sprintf(full, "./%s", name);
+        else sprintf(full, "%.*s/%s", (int) dirLen, dir, name);
+        if (stat(full, &sb) == 0 && S_ISREG(sb.st_mode) && access(full, X_OK) == 0) {
+            if (full[0] != '/') {
+                free(relPath);
+                return relPath = full;
+            }
+            if (cmdCache.count * 4 >= cmdCache.cap * 3) {
+                struct cmdEntry *old = cmdCache.slots;
+                size_t oldCap = cmdCache.cap;
+                cmdCache.cap = oldCap ? oldCap * 2 : 64;
+                cmdCache.slots = calloc(cmdCache.cap, sizeof(struct cmdEntry));
+                if (cmdCache.slots == NULL) {
+                    fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                for (size_t i = 0; i < oldCap; i++) {
+                    if (old[i].name != NULL) *find_cmd(old[i].name) = old[i];
+                }
+                free(old);
+            }
+            e = find_cmd(name);
+            e->name = strdup(name);
+            e->path = full;
+            e->hits = 1;
+            cmdCache.count++;
+            return full;
+        }
+        free(full);
+        if (*end == '\0') return NULL;
+    }
+}
+
+// The slot holding name, or the empty slot where it would go; NULL while the
+// table is empty.
+struct cmdEntry *find_cmd(char *name) {
+    unsigned long h = 5381;
+    size_t i;
+    if (cmdCache.cap == 0) return NULL;
+    for (char *c = name; *c; c++) h = h * 33 + (unsigned char) *c;
+    for (i = h & (cmdCache.cap - 1); cmdCache.slots[i].name != NULL; i = (i + 1) & (cmdCache.cap - 1)) {
+        if (strcmp(cmdCache.slots[i].name, name) == 0) break;
+    }
+    return &cmdCache.slots[i];
+}
+
+// Drops name after its exec failed with ENOENT. The rest of the cluster is
+// put back so lookups past the hole still find their entries.
+void forget_cmd(char *name) {
+    struct cmdEntry *e = find_cmd(name), moved;
+    size_t i;
+    if (e == NULL || e->name == NULL) return;
+    free(e->name);
+    free(e->path);
+    e->name = NULL;
+    cmdCache.count--;
+    for (i = (e - cmdCache.slots + 1) & (cmdCache.cap - 1); cmdCache.slots[i].name != NULL;
+         i = (i + 1) & (cmdCache.cap - 1)) {
+        moved = cmdCache.slots[i];
+        cmdCache.slots[i].name = NULL;
+        *find_cmd(moved.name) = moved;
+    }
+}
+
+void clear_cmds() {
+    for (size_t i = 0; i < cmdCache.cap; i++) {
+        free(cmdCache.slots[i].name);
+        free(cmdCache.slots[i].path);
+    }
+    free(cmdCache.slots);
+    free(cmdCache.pathVar);
+    cmdCache.slots = NULL;
+    cmdCache.pathVar = NULL;
+    cmdCache.cap = cmdCache.count = 0;
+}
+
+// hash: lists the remembered commands with their hit counts, then the
+// lookup counters; hash -r forgets them all.
+int run_hash(char *arg) {
+    if (arg != NULL && strcmp(arg, "-r") == 0) {
+        clear_cmds();
+        return 0;
+    }
+    if (arg != NULL) {
+        fprintf(stderr, "hash: usage: hash [-r]\n");
+        return 1 << 8;
+    }
+    if (cmdCache.count == 0) {
+        fprintf(stdout, "hash: hash table empty\n");
+    } else {
+        fprintf(stdout, "hits\tcommand\n");
+        for (size_t i = 0; i < cmdCache.cap; i++) {
+            if (cmdCache.slots[i].name != NULL)
+                fprintf(stdout, "%4lu\t%s\n", cmdCache.slots[i].hits, cmdCache.slots[i].path);
+        }
+    }
+    fprintf(stdout, "hash: %lu hits, %lu misses\n", cmdCache.hits, cmdCache.misses);
+    return 0;
+}
+
 void check_error(int fd, int n, char *s, int type, int return_code) {
     if (fd < 0 || n < 0) {
         switch (type) {
@@ -261,6 +579,9 @@ void check_error(int fd, int n, char *s, int type, int return_code) {
             case GETLINE:
                 fprintf(stderr, "Failed to getline: %s\n", strerror(errno));
                 break;
+            case PIPE:
+                fprintf(stderr, "Can't create pipe: %s\n", strerror(errno));
+                break;
             default:
                 break;
         }